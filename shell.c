@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // For tee(), splice() and memfd_create()
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -6,6 +7,31 @@
 #include <sys/wait.h>
 #include <sys/stat.h> // For open() and creat()
 #include <fcntl.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h> // For PIPE_BUF
+#include <sys/mman.h> // For memfd_create()
+
+// Max bytes duplicated by a single tee() call for '>=' redirection
+#define TEE_CHUNK 65536
+
+// How a command's stdout is redirected
+#define REDIR_NONE 0
+#define REDIR_NEW 1     // '>': into a new file
+#define REDIR_PREPEND 2 // '>+': in front of the file's current contents
+#define REDIR_TEE 3     // '>=': into a new file and to stdout
+
+// Token types for if/for/while blocks
+#define TOK_WORD 0
+#define TOK_SEP 1   // ';' or newline
+#define TOK_REDIR 2 // '>', '>+', '>=' or '<<<'
+#define TOK_BAD 3   // '<' and '<<' are not supported inside blocks
+
+// Syntax tree node kinds for if/for/while blocks
+#define NODE_CMD 0
+#define NODE_IF 1
+#define NODE_WHILE 2
+#define NODE_FOR 3
 
 /* Unix Shell Project
  *
@@ -20,6 +46,46 @@ typedef struct redir {
     char* to;
 } redir_t;
 
+// A token of an if/for/while block; text is NULL for TOK_SEP and TOK_BAD
+typedef struct token {
+    int type;
+    char* text;
+} token_t;
+
+// Tokens of a block and the parser's position in them
+typedef struct parser {
+    token_t* toks;
+    int ntoks, cap, pos, error;
+} parser_t;
+
+// Syntax tree node. Strings point into the parser's tokens, they are not owned
+typedef struct node {
+    int kind;
+    char** argv;       // NODE_CMD: command words, NODE_FOR: words to loop over
+    int argc;
+    int has_var;       // Some word in argv needs '$' expansion
+    int redir_kind;    // NODE_CMD: REDIR_* of stdout into target
+    char* target;
+    char* here_string; // NODE_CMD: word given with "<<<", or NULL
+    char* var;         // NODE_FOR: loop variable
+    struct node *cond, *body, *else_body;
+    struct node* next; // Next command in the same list
+} node_t;
+
+// Per-session counters, shown by the shellstats built-in
+typedef struct shell_stats {
+    unsigned long lines_read;
+    unsigned long commands_spawned;
+    unsigned long builtins_run;
+    unsigned long bytes_copied;        // By file_copy() for '>+' and tee_copy() for '>='
+    unsigned long redirections_opened;
+    unsigned long parser_allocs;       // Heap allocations made while parsing commands
+    unsigned long exec_failures;       // execvp() calls that failed in the child
+} shell_stats_t;
+
+shell_stats_t stats;
+int stats_json_fd = -1; // Batch mode: dump stats as JSON here at exit
+
 /* Wrapper function to print string to stdout */
 void myPrint(char *msg)
 {
@@ -51,6 +117,7 @@ char* rm_whitespace(char* str) {
             count++; // count whitespace characters
         }
     }
+    stats.parser_allocs++;
     char* res = (char*) malloc((length - count) + 1);
     if (res == NULL) {
         printError();
@@ -130,6 +197,7 @@ redir_t* redir_init(char* str) {
     strLen1 = strlen(token1);
     strLen2 = strlen(token2);
 
+    stats.parser_allocs++;
     res1 = (char*) malloc(strLen1 + 2);
     if (res1 == NULL) {
         printError();
@@ -141,6 +209,7 @@ redir_t* redir_init(char* str) {
 
     // Always have newline character '\n' in there
     if (char_in_str(token2, '\n')) {
+        stats.parser_allocs++;
         res2 = (char*) malloc(strLen2 + 1);
         if (res2 == NULL) {
             printError();
@@ -149,6 +218,7 @@ redir_t* redir_init(char* str) {
         strcpy(res2, token2);
         res2[strLen2] = '\0';
     } else {
+        stats.parser_allocs++;
         res2 = (char*) malloc(strLen2 + 2);
         if (res2 == NULL) {
             printError();
@@ -160,6 +230,7 @@ redir_t* redir_init(char* str) {
     }
 
     // Make the struct
+    stats.parser_allocs++;
     redir_t* redir_res = (redir_t*) malloc(sizeof(redir_t));
     if (redir_res == NULL) {
         printError();
@@ -215,6 +286,7 @@ int just_redir(char *str) {
 int file_copy(char *filename1, char *filename2) {
     FILE *file1, *file2;
     char copyChar;
+    unsigned long copied = 0;
 
     if (!is_file_real(filename1) || !is_file_real(filename2)) {
         return 1;
@@ -233,7 +305,9 @@ int file_copy(char *filename1, char *filename2) {
     // Copy contents of file1 into file2
     for (copyChar = fgetc(file1); copyChar != EOF; copyChar = fgetc(file1)) {
         fputc(copyChar, file2);
+        copied++;
     }
+    stats.bytes_copied += copied;
 
     fclose(file1);
     fclose(file2);
@@ -241,6 +315,315 @@ int file_copy(char *filename1, char *filename2) {
     return 0; /* SUCCESS */
 }
 
+/* Write all len bytes of buf to fd, retrying on short writes */
+int write_all(int fd, char *buf, ssize_t len) {
+    ssize_t n;
+    while (len > 0) {
+        if ((n = write(fd, buf, len)) <= 0) return 1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Move exactly len bytes out of the pipe in_fd into out_fd with splice().
+ * Falls back to read()/write() if out_fd does not support splice(). */
+int splice_all(int in_fd, int out_fd, ssize_t len) {
+    char buf[4096];
+    ssize_t n;
+    while (len > 0) {
+        n = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINVAL) {
+            n = read(in_fd, buf, (len < (ssize_t) sizeof(buf)) ? len : (ssize_t) sizeof(buf));
+            if (n > 0 && write_all(out_fd, buf, n) != 0) return 1;
+        }
+        if (n <= 0) return 1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Copy everything written into the pipe in_fd to both file_fd and stdout.
+ * The bytes are duplicated with tee() and moved with splice(), so they never
+ * pass through user space. tee() needs a pipe on both ends, so if stdout is
+ * not already a pipe the copy goes through an extra fan-out pipe. */
+int tee_copy(int in_fd, int file_fd) {
+    int fanout[2] = {-1, -1}, to_stdout, ret = 0;
+    struct stat st;
+    ssize_t n;
+
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode)) {
+        to_stdout = STDOUT_FILENO;
+    } else {
+        if (pipe(fanout) < 0) return 1;
+        to_stdout = fanout[1];
+    }
+
+    while ((n = tee(in_fd, to_stdout, TEE_CHUNK, 0)) > 0) {
+        // Drain the duplicate to stdout, then consume the original into the file
+        if (fanout[0] >= 0 && splice_all(fanout[0], STDOUT_FILENO, n) != 0) {
+            ret = 1;
+            break;
+        }
+        if (splice_all(in_fd, file_fd, n) != 0) {
+            ret = 1;
+            break;
+        }
+        stats.bytes_copied += n;
+    }
+    if (n < 0) ret = 1;
+
+    if (fanout[0] >= 0) {
+        close(fanout[0]);
+        close(fanout[1]);
+    }
+    return ret;
+}
+
+/* Return a readable fd holding the len bytes of body, to be used as stdin.
+ * Small bodies go into a pipe (a write of at most PIPE_BUF bytes never
+ * blocks), larger ones into an anonymous memfd, so nothing touches the disk. */
+int body_fd(char *body, size_t len) {
+    int fds[2], fd;
+
+    if (len <= PIPE_BUF) {
+        if (pipe(fds) < 0) return -1;
+        if (write_all(fds[1], body, len) != 0) {
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        close(fds[1]);
+        return fds[0];
+    }
+
+    fd = memfd_create("heredoc", MFD_CLOEXEC);
+    if (fd < 0) return -1;
+    if (write_all(fd, body, len) != 0 || lseek(fd, 0, SEEK_SET) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Read here-document lines from in until a line equal to delim (or EOF).
+ * Lines are echoed in batch mode and prompted for with "> " otherwise.
+ * Returns the body on the heap and stores its length in len. */
+char* heredoc_read(FILE *in, char *delim, int batch, size_t *len) {
+    char *line = NULL, *body = NULL, *tmp;
+    size_t line_cap = 0, body_cap = 0, line_len;
+    ssize_t n;
+
+    *len = 0;
+    while (1) {
+        if (!batch) myPrint("> ");
+        if ((n = getline(&line, &line_cap, in)) < 0) break;
+        stats.lines_read++;
+        if (batch) myPrint(line);
+
+        // Compare against the delimiter without the trailing newline
+        line_len = (line[n - 1] == '\n') ? (size_t) n - 1 : (size_t) n;
+        if (line_len == strlen(delim) && strncmp(line, delim, line_len) == 0) break;
+
+        if (*len + n > body_cap) {
+            body_cap = (*len + n) * 2;
+            stats.parser_allocs++;
+            tmp = (char*) realloc(body, body_cap);
+            if (tmp == NULL) {
+                printError();
+                exit(1);
+            }
+            body = tmp;
+        }
+        memcpy(body + *len, line, n);
+        *len += n;
+    }
+    free(line);
+    return body;
+}
+
+/* Given a command containing "<<WORD" (here-document) or "<<< word"
+ * (here-string), blank the operator and its word out of the command and
+ * return an fd for the child's stdin, or -1 on error. */
+int heredoc_init(char *cmd, FILE *in, int batch) {
+    char *op = strstr(cmd, "<<"), *word, *body;
+    unsigned int i, word_len;
+    int here_string, fd;
+    size_t len;
+
+    here_string = (op[2] == '<');
+    i = here_string ? 3 : 2;
+    while (is_whitespace(op[i]) && op[i] != '\n') i++;
+    word = &op[i];
+    word_len = 0;
+    while (word[word_len] != '\0' && !is_whitespace(word[word_len]) &&
+        word[word_len] != '<' && word[word_len] != '>') word_len++;
+    if (word_len == 0) return -1;
+
+    if (here_string) {
+        // The word itself is the body, followed by a newline
+        stats.parser_allocs++;
+        body = (char*) malloc(word_len + 1);
+        if (body == NULL) {
+            printError();
+            exit(1);
+        }
+        memcpy(body, word, word_len);
+        body[word_len] = '\n';
+        len = word_len + 1;
+    } else {
+        char delim[word_len + 1];
+        memcpy(delim, word, word_len);
+        delim[word_len] = '\0';
+        body = heredoc_read(in, delim, batch, &len);
+    }
+
+    // Remove "<<WORD" from the command so it is not passed as an argument
+    memset(op, ' ', (word + word_len) - op);
+
+    fd = body_fd(body, len);
+    free(body);
+    return fd;
+}
+
+/* fork() and execvp() the NULL-terminated arr, with stdout redirected into
+ * target according to redir_kind and stdin read from stdin_fd if it is >= 0.
+ * Returns the command's exit status, or -1 if it did not run to completion. */
+int spawn_command(char **arr, int redir_kind, char *target, int stdin_fd) {
+    int childState, redirect_fd, tee_fd = -1, tee_pipe[2], exec_pipe[2], exec_errno;
+    int prepend_existing = 0;
+    pid_t childName;
+
+    // Prepending to an existing file writes the output to a new file first
+    if (redir_kind == REDIR_PREPEND && is_file_real(target)) prepend_existing = 1;
+
+    // Tee: the child writes into a pipe that the parent copies to the file and stdout
+    if (redir_kind == REDIR_TEE) {
+        tee_fd = open(target, O_CREAT | O_WRONLY | O_TRUNC, 000666);
+        if (tee_fd < 0 || pipe(tee_pipe) < 0) {
+            if (tee_fd >= 0) close(tee_fd);
+            printError();
+            return -1;
+        }
+    }
+
+    // The child reports a failed execvp() through this pipe. It is closed on a
+    // successful exec, so the parent then reads 0 bytes.
+    if (pipe2(exec_pipe, O_CLOEXEC) < 0) {
+        if (redir_kind == REDIR_TEE) {
+            close(tee_fd);
+            close(tee_pipe[0]);
+            close(tee_pipe[1]);
+        }
+        printError();
+        return -1;
+    }
+
+    if ((childName = fork()) == 0) { // Child process
+        close(exec_pipe[0]);
+        if (redir_kind == REDIR_NEW || redir_kind == REDIR_PREPEND) {
+            // 000666 -> All permissions - from man pages
+            if (prepend_existing) {
+                redirect_fd = open("bryans_special_filename.txt", O_CREAT | O_RDWR, 000666);
+            } else {
+                redirect_fd = open(target, O_CREAT | O_RDWR, 000666);
+            }
+
+            if (redirect_fd < 0) {
+                printError();
+                _exit(0);
+            }
+
+            if (dup2(redirect_fd, STDOUT_FILENO) < 0) {
+                printError();
+                _exit(0);
+            }
+            close(redirect_fd);
+        } else if (redir_kind == REDIR_TEE) {
+            close(tee_fd);
+            close(tee_pipe[0]);
+            if (dup2(tee_pipe[1], STDOUT_FILENO) < 0) {
+                printError();
+                _exit(0);
+            }
+            close(tee_pipe[1]);
+        }
+
+        if (stdin_fd >= 0) {
+            if (dup2(stdin_fd, STDIN_FILENO) < 0) {
+                printError();
+                _exit(0);
+            }
+            close(stdin_fd);
+        }
+
+        // Execute the command
+        execvp(arr[0], arr);
+
+        // If execvp() is success, should not return. _exit() leaves the
+        // batch file's stdio buffer (and so the shared offset) alone.
+        exec_errno = errno;
+        write(exec_pipe[1], &exec_errno, sizeof(exec_errno));
+        printError();
+        _exit(127);
+    } else if (childName < 0) {
+        close(exec_pipe[0]);
+        close(exec_pipe[1]);
+        if (redir_kind == REDIR_TEE) {
+            close(tee_fd);
+            close(tee_pipe[0]);
+            close(tee_pipe[1]);
+        }
+        printError();
+        return -1;
+    }
+
+    // Parent process
+    stats.commands_spawned++;
+    if (redir_kind != REDIR_NONE) stats.redirections_opened++;
+    if (stdin_fd >= 0) stats.redirections_opened++;
+
+    close(exec_pipe[1]);
+    if (read(exec_pipe[0], &exec_errno, sizeof(exec_errno)) > 0) stats.exec_failures++;
+    close(exec_pipe[0]);
+
+    if (redir_kind == REDIR_TEE) {
+        close(tee_pipe[1]);
+        if (0 != tee_copy(tee_pipe[0], tee_fd)) printError();
+        close(tee_pipe[0]);
+        close(tee_fd);
+    }
+
+    // Wait for child process to finish
+    waitpid(childName, &childState, 0);
+    if (!WIFEXITED(childState)) {
+        // Error
+        printError();
+        return -1;
+    }
+
+    // For Advanced Redirection prepending, if the given file already exists
+    if (prepend_existing) {
+        // Copy contents
+        if (0 != file_copy(target, "bryans_special_filename.txt")) {
+            printError();
+            exit(0);
+        }
+        // Delete old
+        if (0 != remove(target)) {
+            printError();
+            exit(0);
+        }
+        // Rename new
+        if (0 != rename("bryans_special_filename.txt", target)) {
+            printError();
+            exit(0);
+        }
+    }
+
+    return WEXITSTATUS(childState);
+}
+
 /* Return wheter the given string has more arguments than 1 */
 int more_args_than_one(char *str) {
     unsigned int i = 0, count = 0;
@@ -256,6 +639,594 @@ int more_args_than_one(char *str) {
     return ((count - 1) > 1);
 }
 
+/* Copy the first n chars of str into a new string on the heap */
+char* copy_str(char *str, size_t n) {
+    stats.parser_allocs++;
+    char* res = (char*) malloc(n + 1);
+    if (res == NULL) {
+        printError();
+        exit(1);
+    }
+    memcpy(res, str, n);
+    res[n] = '\0';
+    return res;
+}
+
+/* Append a token to the parser's token list */
+void add_token(parser_t *p, int type, char *text) {
+    if (p->ntoks == p->cap) {
+        p->cap = (p->cap == 0) ? 64 : p->cap * 2;
+        stats.parser_allocs++;
+        p->toks = (token_t*) realloc(p->toks, sizeof(token_t) * p->cap);
+        if (p->toks == NULL) {
+            printError();
+            exit(1);
+        }
+    }
+    p->toks[p->ntoks].type = type;
+    p->toks[p->ntoks].text = text;
+    p->ntoks++;
+}
+
+/* Split one line of a block into tokens. This is the only time the text of
+ * a block is scanned; everything after works on the tokens. */
+void lex_line(parser_t *p, char *line) {
+    unsigned int i = 0, start;
+    while (line[i] != '\0') {
+        if (line[i] == '\n' || line[i] == ';') {
+            add_token(p, TOK_SEP, NULL);
+            i++;
+        } else if (is_whitespace(line[i])) {
+            i++;
+        } else if (line[i] == '>') {
+            if (line[i + 1] == '+' || line[i + 1] == '=') {
+                add_token(p, TOK_REDIR, copy_str(&line[i], 2));
+                i += 2;
+            } else {
+                add_token(p, TOK_REDIR, copy_str(&line[i], 1));
+                i++;
+            }
+        } else if (line[i] == '<') {
+            if (strncmp(&line[i], "<<<", 3) == 0) {
+                add_token(p, TOK_REDIR, copy_str(&line[i], 3));
+                i += 3;
+            } else {
+                add_token(p, TOK_BAD, NULL);
+                while (line[i] == '<') i++;
+            }
+        } else {
+            start = i;
+            while (line[i] != '\0' && !is_whitespace(line[i]) && line[i] != ';' &&
+                line[i] != '>' && line[i] != '<') i++;
+            add_token(p, TOK_WORD, copy_str(&line[start], i - start));
+        }
+    }
+}
+
+/* Frees the parser's tokens */
+void parser_free(parser_t *p) {
+    int i;
+    for (i=0; i<p->ntoks; i++) {
+        free(p->toks[i].text);
+    }
+    free(p->toks);
+}
+
+/* Does the line start with "if", "for" or "while"? */
+int block_start(char *line) {
+    char *keywords[3] = {"if", "for", "while"};
+    unsigned int i = 0, k, len;
+    while (is_whitespace(line[i])) i++;
+    for (k=0; k<3; k++) {
+        len = strlen(keywords[k]);
+        if (strncmp(&line[i], keywords[k], len) == 0 && (line[i + len] == '\0' ||
+            is_whitespace(line[i + len]) || line[i + len] == ';')) return 1;
+    }
+    return 0;
+}
+
+/* How many if/for/while blocks are still open after the tokens so far?
+ * Keywords only count where a command can start. */
+int block_depth(parser_t *p) {
+    int i, depth = 0, cmd_pos = 1;
+    char *w;
+    for (i=0; i<p->ntoks; i++) {
+        if (p->toks[i].type == TOK_SEP) {
+            cmd_pos = 1;
+            continue;
+        }
+        if (p->toks[i].type != TOK_WORD || !cmd_pos) {
+            cmd_pos = 0;
+            continue;
+        }
+        w = p->toks[i].text;
+        if (strcmp(w, "if") == 0 || strcmp(w, "for") == 0 || strcmp(w, "while") == 0) {
+            depth++;
+        } else if (strcmp(w, "fi") == 0 || strcmp(w, "done") == 0) {
+            depth--;
+        }
+        // A command can directly follow these keywords
+        cmd_pos = (strcmp(w, "if") == 0 || strcmp(w, "while") == 0 || strcmp(w, "then") == 0 ||
+            strcmp(w, "do") == 0 || strcmp(w, "else") == 0 || strcmp(w, "elif") == 0);
+    }
+    return depth;
+}
+
+/* Is the current token the word w? */
+int at_word(parser_t *p, char *w) {
+    return (p->pos < p->ntoks && p->toks[p->pos].type == TOK_WORD &&
+        strcmp(p->toks[p->pos].text, w) == 0);
+}
+
+/* Skip over the word w if it is the current token */
+int expect_word(parser_t *p, char *w) {
+    if (!at_word(p, w)) return 0;
+    p->pos++;
+    return 1;
+}
+
+/* Allocate an empty syntax tree node */
+node_t* new_node(int kind) {
+    stats.parser_allocs++;
+    node_t* n = (node_t*) calloc(1, sizeof(node_t));
+    if (n == NULL) {
+        printError();
+        exit(1);
+    }
+    n->kind = kind;
+    n->redir_kind = REDIR_NONE;
+    return n;
+}
+
+/* Append word w to the node's NULL-terminated argv */
+void push_arg(node_t *n, char *w) {
+    stats.parser_allocs++;
+    n->argv = (char**) realloc(n->argv, sizeof(char*) * (n->argc + 2));
+    if (n->argv == NULL) {
+        printError();
+        exit(1);
+    }
+    n->argv[n->argc++] = w;
+    n->argv[n->argc] = NULL;
+    if (strchr(w, '$')) n->has_var = 1;
+}
+
+/* Frees a syntax tree (but not the token strings it points to) */
+void free_tree(node_t *n) {
+    node_t *next;
+    while (n != NULL) {
+        next = n->next;
+        free_tree(n->cond);
+        free_tree(n->body);
+        free_tree(n->else_body);
+        free(n->argv);
+        free(n);
+        n = next;
+    }
+}
+
+node_t* parse_command(parser_t *p);
+
+/* Parse commands up to one of the stop keywords (NULL if unused) or the end */
+node_t* parse_list(parser_t *p, char *stop1, char *stop2, char *stop3) {
+    node_t *head = NULL, *tail = NULL, *n;
+    while (!p->error) {
+        while (p->pos < p->ntoks && p->toks[p->pos].type == TOK_SEP) p->pos++;
+        if (p->pos >= p->ntoks) break;
+        if ((stop1 && at_word(p, stop1)) || (stop2 && at_word(p, stop2)) ||
+            (stop3 && at_word(p, stop3))) break;
+
+        n = parse_command(p);
+        if (head == NULL) {
+            head = n;
+        } else {
+            tail->next = n;
+        }
+        tail = n;
+    }
+    return head;
+}
+
+/* if LIST then LIST [elif LIST then LIST]... [else LIST] fi */
+node_t* parse_if(parser_t *p) {
+    node_t* n = new_node(NODE_IF);
+    p->pos++; // "if" or "elif"
+
+    n->cond = parse_list(p, "then", NULL, NULL);
+    if (p->error || n->cond == NULL || !expect_word(p, "then")) {
+        p->error = 1;
+        return n;
+    }
+    n->body = parse_list(p, "elif", "else", "fi");
+    if (p->error || n->body == NULL) {
+        p->error = 1;
+        return n;
+    }
+
+    // "elif" is an if nested in the else part, and it consumes the "fi"
+    if (at_word(p, "elif")) {
+        n->else_body = parse_if(p);
+        return n;
+    }
+    if (expect_word(p, "else")) {
+        n->else_body = parse_list(p, "fi", NULL, NULL);
+        if (n->else_body == NULL) p->error = 1;
+    }
+    if (p->error || !expect_word(p, "fi")) p->error = 1;
+    return n;
+}
+
+/* while LIST do LIST done */
+node_t* parse_while(parser_t *p) {
+    node_t* n = new_node(NODE_WHILE);
+    p->pos++; // "while"
+
+    n->cond = parse_list(p, "do", NULL, NULL);
+    if (p->error || n->cond == NULL || !expect_word(p, "do")) {
+        p->error = 1;
+        return n;
+    }
+    n->body = parse_list(p, "done", NULL, NULL);
+    if (p->error || n->body == NULL || !expect_word(p, "done")) p->error = 1;
+    return n;
+}
+
+/* for NAME in WORD... ; do LIST done */
+node_t* parse_for(parser_t *p) {
+    node_t* n = new_node(NODE_FOR);
+    unsigned int i;
+    p->pos++; // "for"
+
+    if (p->pos >= p->ntoks || p->toks[p->pos].type != TOK_WORD) {
+        p->error = 1;
+        return n;
+    }
+    n->var = p->toks[p->pos++].text;
+    if (!isalpha(n->var[0]) && n->var[0] != '_') p->error = 1;
+    for (i=1; n->var[i] != '\0'; i++) {
+        if (!isalnum(n->var[i]) && n->var[i] != '_') p->error = 1;
+    }
+    if (p->error || !expect_word(p, "in")) {
+        p->error = 1;
+        return n;
+    }
+
+    while (p->pos < p->ntoks && p->toks[p->pos].type == TOK_WORD) {
+        push_arg(n, p->toks[p->pos++].text);
+    }
+    if (p->pos < p->ntoks && p->toks[p->pos].type != TOK_SEP) {
+        p->error = 1;
+        return n;
+    }
+    while (p->pos < p->ntoks && p->toks[p->pos].type == TOK_SEP) p->pos++;
+
+    if (!expect_word(p, "do")) {
+        p->error = 1;
+        return n;
+    }
+    n->body = parse_list(p, "done", NULL, NULL);
+    if (p->error || n->body == NULL || !expect_word(p, "done")) p->error = 1;
+    return n;
+}
+
+/* A command's words, with at most one of '>', '>+', '>=' and one "<<<" */
+node_t* parse_simple(parser_t *p) {
+    node_t* n = new_node(NODE_CMD);
+    token_t* t;
+
+    while (p->pos < p->ntoks && p->toks[p->pos].type != TOK_SEP) {
+        t = &p->toks[p->pos++];
+        if (t->type == TOK_BAD) {
+            p->error = 1;
+            return n;
+        } else if (t->type == TOK_REDIR) {
+            if (p->pos >= p->ntoks || p->toks[p->pos].type != TOK_WORD) {
+                p->error = 1;
+                return n;
+            }
+            if (strcmp(t->text, "<<<") == 0) {
+                if (n->here_string != NULL) p->error = 1;
+                n->here_string = p->toks[p->pos++].text;
+            } else {
+                if (n->redir_kind != REDIR_NONE) p->error = 1;
+                if (strcmp(t->text, ">+") == 0) {
+                    n->redir_kind = REDIR_PREPEND;
+                } else if (strcmp(t->text, ">=") == 0) {
+                    n->redir_kind = REDIR_TEE;
+                } else {
+                    n->redir_kind = REDIR_NEW;
+                }
+                n->target = p->toks[p->pos++].text;
+            }
+        } else {
+            push_arg(n, t->text);
+        }
+    }
+    if (n->argc == 0) p->error = 1;
+    return n;
+}
+
+/* Parse a single command: a simple command or an if/while/for block */
+node_t* parse_command(parser_t *p) {
+    node_t* n;
+    char* w = p->toks[p->pos].text;
+
+    if (at_word(p, "if")) {
+        n = parse_if(p);
+    } else if (at_word(p, "while")) {
+        n = parse_while(p);
+    } else if (at_word(p, "for")) {
+        n = parse_for(p);
+    } else {
+        // Keywords that close or continue a block cannot start a command
+        if (w != NULL && (strcmp(w, "then") == 0 || strcmp(w, "else") == 0 ||
+            strcmp(w, "elif") == 0 || strcmp(w, "fi") == 0 || strcmp(w, "do") == 0 ||
+            strcmp(w, "done") == 0)) p->error = 1;
+        return parse_simple(p);
+    }
+
+    // A block must be followed by ';', a newline or the end
+    if (p->pos < p->ntoks && p->toks[p->pos].type != TOK_SEP) p->error = 1;
+    return n;
+}
+
+/* Replace each "$name" in word with the variable's value (empty if unset).
+ * Returns a new string on the heap. */
+char* expand_word(char *word) {
+    size_t len = 0, cap = strlen(word) + 1, vlen, nlen;
+    char *res = (char*) malloc(cap), *val, name[256];
+    unsigned int i = 0;
+    if (res == NULL) {
+        printError();
+        exit(1);
+    }
+
+    while (word[i] != '\0') {
+        if (word[i] == '$' && (isalpha(word[i + 1]) || word[i + 1] == '_')) {
+            i++;
+            nlen = 0;
+            while ((isalnum(word[i]) || word[i] == '_') && nlen < sizeof(name) - 1) {
+                name[nlen++] = word[i++];
+            }
+            name[nlen] = '\0';
+            val = getenv(name);
+            if (val == NULL) val = "";
+            vlen = strlen(val);
+        } else {
+            val = &word[i++];
+            vlen = 1;
+        }
+
+        if (len + vlen + 1 > cap) {
+            cap = (len + vlen + 1) * 2;
+            res = (char*) realloc(res, cap);
+            if (res == NULL) {
+                printError();
+                exit(1);
+            }
+        }
+        memcpy(res + len, val, vlen);
+        len += vlen;
+    }
+    res[len] = '\0';
+    return res;
+}
+
+/* Write the session counters to fd, as a table or as a JSON object */
+void stats_write(int fd, int json) {
+    char buf[512];
+    int n;
+    if (json) {
+        n = snprintf(buf, sizeof(buf), "{\"lines_read\": %lu, \"commands_spawned\": %lu, "
+            "\"builtins_run\": %lu, \"bytes_copied\": %lu, \"redirections_opened\": %lu, "
+            "\"parser_allocs\": %lu, \"exec_failures\": %lu}\n",
+            stats.lines_read, stats.commands_spawned, stats.builtins_run, stats.bytes_copied,
+            stats.redirections_opened, stats.parser_allocs, stats.exec_failures);
+    } else {
+        n = snprintf(buf, sizeof(buf), "lines read:          %lu\n"
+            "commands spawned:    %lu\n"
+            "built-ins run:       %lu\n"
+            "bytes copied:        %lu\n"
+            "redirections opened: %lu\n"
+            "parser allocations:  %lu\n"
+            "exec failures:       %lu\n",
+            stats.lines_read, stats.commands_spawned, stats.builtins_run, stats.bytes_copied,
+            stats.redirections_opened, stats.parser_allocs, stats.exec_failures);
+    }
+    write_all(fd, buf, n);
+}
+
+/* atexit() handler: write the counters as JSON to stats_json_fd, if open */
+void stats_at_exit(void) {
+    if (stats_json_fd < 0) return;
+    stats_write(stats_json_fd, 1);
+    close(stats_json_fd);
+}
+
+/* Run exit, pwd, cd or shellstats in-process. Like on the command line they
+ * take no redirection, pwd and exit take no arguments, and shellstats takes
+ * an optional "json". Returns the exit status, or -1 if argv[0] is not a
+ * built-in. */
+int run_builtin(char **argv, int argc, int redirected) {
+    char cwd[FILENAME_MAX], *dir;
+
+    if (strcmp(argv[0], "exit") == 0 || strcmp(argv[0], "pwd") == 0 ||
+        strcmp(argv[0], "cd") == 0 || strcmp(argv[0], "shellstats") == 0) {
+        stats.builtins_run++;
+    }
+
+    if (strcmp(argv[0], "exit") == 0) {
+        if (argc > 1 || redirected) {
+            printError();
+            return 1;
+        }
+        exit(0);
+    } else if (strcmp(argv[0], "pwd") == 0) {
+        if (argc > 1 || redirected || getcwd(cwd, sizeof(cwd)) == NULL) {
+            printError();
+            return 1;
+        }
+        myPrint(cwd);
+        myPrint("\n");
+        return 0;
+    } else if (strcmp(argv[0], "cd") == 0) {
+        dir = (argc == 1) ? getenv("HOME") : argv[1];
+        if (argc > 2 || redirected || dir == NULL || chdir(dir) != 0) {
+            printError();
+            return 1;
+        }
+        return 0;
+    } else if (strcmp(argv[0], "shellstats") == 0) {
+        if (argc > 2 || redirected || (argc == 2 && strcmp(argv[1], "json") != 0)) {
+            printError();
+            return 1;
+        }
+        stats_write(STDOUT_FILENO, argc == 2);
+        return 0;
+    }
+    return -1;
+}
+
+/* Run a simple command node. Words without '$' are used as parsed; only the
+ * ones with a variable in them are rebuilt on each run. */
+int exec_simple(node_t *n) {
+    char **argv = n->argv, *target = n->target, *body;
+    int i, status, stdin_fd = -1;
+    size_t len;
+
+    if (n->has_var) {
+        argv = (char**) malloc(sizeof(char*) * (n->argc + 1));
+        if (argv == NULL) {
+            printError();
+            exit(1);
+        }
+        for (i=0; i<n->argc; i++) {
+            argv[i] = strchr(n->argv[i], '$') ? expand_word(n->argv[i]) : n->argv[i];
+        }
+        argv[n->argc] = NULL;
+    }
+    if (target != NULL && strchr(target, '$')) target = expand_word(target);
+
+    status = run_builtin(argv, n->argc, n->redir_kind != REDIR_NONE || n->here_string != NULL);
+    if (status < 0) {
+        if (n->here_string != NULL) {
+            // The body is the word plus a newline, which takes the place of the '\0'
+            body = expand_word(n->here_string);
+            len = strlen(body);
+            body[len] = '\n';
+            stdin_fd = body_fd(body, len + 1);
+            free(body);
+        }
+
+        if (n->here_string != NULL && stdin_fd < 0) {
+            printError();
+            status = 1;
+        } else if ((n->redir_kind == REDIR_NEW || n->redir_kind == REDIR_TEE) &&
+            is_file_real(target)) {
+            // Should not be an existing file
+            printError();
+            status = 1;
+        } else {
+            status = spawn_command(argv, n->redir_kind, target, stdin_fd);
+            if (status < 0) status = 1;
+        }
+        if (stdin_fd >= 0) close(stdin_fd);
+    }
+
+    if (n->has_var) {
+        for (i=0; i<n->argc; i++) {
+            if (argv[i] != n->argv[i]) free(argv[i]);
+        }
+        free(argv);
+    }
+    if (target != n->target) free(target);
+    return status;
+}
+
+int exec_list(node_t *n);
+
+/* Run one node of the syntax tree and return its exit status */
+int exec_node(node_t *n) {
+    int i, status = 0;
+    char **words;
+
+    switch (n->kind) {
+    case NODE_CMD:
+        return exec_simple(n);
+    case NODE_IF:
+        if (exec_list(n->cond) == 0) return exec_list(n->body);
+        if (n->else_body != NULL) return exec_list(n->else_body);
+        return 0;
+    case NODE_WHILE:
+        while (exec_list(n->cond) == 0) status = exec_list(n->body);
+        return status;
+    case NODE_FOR:
+        // The word list is expanded once, before the first iteration
+        words = n->argv;
+        if (n->has_var) {
+            words = (char**) malloc(sizeof(char*) * n->argc);
+            if (words == NULL) {
+                printError();
+                exit(1);
+            }
+            for (i=0; i<n->argc; i++) words[i] = expand_word(n->argv[i]);
+        }
+        for (i=0; i<n->argc; i++) {
+            setenv(n->var, words[i], 1);
+            status = exec_list(n->body);
+        }
+        if (n->has_var) {
+            for (i=0; i<n->argc; i++) free(words[i]);
+            free(words);
+        }
+        return status;
+    }
+    return 1;
+}
+
+/* Run a list of commands; its exit status is that of the last one */
+int exec_list(node_t *n) {
+    int status = 0;
+    for (; n != NULL; n = n->next) status = exec_node(n);
+    return status;
+}
+
+/* Read an if/for/while block that starts on first_line, along with as many
+ * lines from in as it takes to close it, parse it once and run the tree.
+ * More lines are echoed in batch mode and prompted for with "> " otherwise. */
+void run_block(char *first_line, FILE *in, int batch) {
+    parser_t p = {NULL, 0, 0, 0, 0};
+    char* line = NULL;
+    size_t line_cap = 0;
+    node_t* tree;
+
+    lex_line(&p, first_line);
+    while (block_depth(&p) > 0) {
+        if (!batch) myPrint("> ");
+        if (getline(&line, &line_cap, in) < 0) {
+            p.error = 1; // The block is never closed
+            break;
+        }
+        stats.lines_read++;
+        if (batch) myPrint(line);
+        lex_line(&p, line);
+    }
+    free(line);
+
+    if (!p.error) {
+        tree = parse_list(&p, NULL, NULL, NULL);
+        if (p.error) {
+            printError();
+        } else {
+            exec_list(tree);
+        }
+        free_tree(tree);
+    } else {
+        printError();
+    }
+    parser_free(&p);
+}
+
 
 /* main: Runs the command line interpreter, i.e. shell */
 int main(int argc, char *argv[])
@@ -276,6 +1247,18 @@ int main(int argc, char *argv[])
     int arg_tmp = 0;
     FILE* file;
     if (argc > 1) arg_tmp = 1;
+
+    // Batch mode can dump the session counters as JSON on exit. The file is
+    // opened now so that a later cd does not change where it goes.
+    if (argc > 1 && getenv("SHELLSTATS_JSON") != NULL) {
+        stats_json_fd = open(getenv("SHELLSTATS_JSON"), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC,
+            000666);
+        if (stats_json_fd < 0) {
+            printError();
+            exit(0);
+        }
+        atexit(stats_at_exit);
+    }
     while (1) {
         if (argc > 1) {
             if (arg_tmp == 1) {
@@ -306,6 +1289,7 @@ int main(int argc, char *argv[])
                 exit(0);
             }
         }
+        stats.lines_read++;
 
         // Command not greater than 512 characters, excluding the newline
         char fgetsVar;
@@ -346,14 +1330,22 @@ int main(int argc, char *argv[])
         // Built-in command for 'exit' (in isolation / by itself)
         if ((strcmp(no_whitespace, "exit\n") == 0)) {
             free(no_whitespace);
+            stats.builtins_run++;
             exit(0);
         }
 
         free(no_whitespace);
 
+        // Control flow: parse the whole block once, then run it from the tree
+        if (block_start(cmd_buff)) {
+            run_block(cmd_buff, (fileCnst == 1) ? file : stdin, arg_tmp == -1);
+            continue;
+        }
+
 
         // START OF COMMANDS (multiple or single)
         int cmdLen = strlen(cmd_buff);
+        stats.parser_allocs++;
         char* commandCopy = (char*) calloc(cmdLen + 1, 1);
         if (commandCopy == NULL) {
             // Error message
@@ -385,12 +1377,60 @@ int main(int argc, char *argv[])
 
         redir_t *redir;
         char filename_buffer[FILENAME_MAX], *redir_ptr;
-        int redirect_fd = -1, redirection_val, complex_redirection_val;
+        int redir_kind, heredoc_fd = -1;
+
+        /* Read the bodies of all here-documents on the line before running any
+         * command, so that body lines are consumed even if the loop below
+         * stops early. heredoc_fds[k] is the stdin of the k-th command: -1 if
+         * it has none, -2 if its here-document is bad. */
+        int numSegments = numMultCommands(cmd_buff), segment;
+        char *segStart = cmd_buff, *segEnd;
+        stats.parser_allocs++;
+        int* heredoc_fds = (int*) malloc(sizeof(int) * numSegments);
+        if (heredoc_fds == NULL) {
+            printError();
+            exit(1);
+        }
+        for (segment=0; segment<numSegments; segment++) {
+            segEnd = strchr(segStart, ';');
+            if (segEnd != NULL) *segEnd = '\0';
+
+            heredoc_fds[segment] = -1;
+            if (strstr(segStart, "<<")) {
+                heredoc_fds[segment] = heredoc_init(segStart, (fileCnst == 1) ? file : stdin,
+                    arg_tmp == -1);
+                if (heredoc_fds[segment] < 0) heredoc_fds[segment] = -2;
+
+                // Only a here-document, no command
+                for (i=0; segStart[i] != '\0'; i++) {
+                    if (!is_whitespace(segStart[i])) break;
+                }
+                if (segStart[i] == '\0' && heredoc_fds[segment] >= 0) {
+                    close(heredoc_fds[segment]);
+                    heredoc_fds[segment] = -2;
+                }
+            }
+
+            if (segEnd != NULL) {
+                *segEnd = ';';
+                segStart = segEnd + 1;
+            }
+        }
+        segment = 0;
 
         // START of loop for commands
         while (commandCounter < commandCounterLimit) {
-            redirection_val = 0;
-            complex_redirection_val = 0;
+            redir_kind = REDIR_NONE;
+            redir_ptr = NULL;
+            if (heredoc_fd >= 0) close(heredoc_fd);
+
+            // Each pass of the loop takes the next ';'-separated command
+            heredoc_fd = -1;
+            if (segment < numSegments) {
+                heredoc_fd = heredoc_fds[segment];
+                heredoc_fds[segment] = -1;
+                segment++;
+            }
 
             i = 0;
             if ((commandCounter + 1) < commandCounterLimit) {
@@ -416,6 +1456,12 @@ int main(int argc, char *argv[])
                 continue;
             }
 
+            // Here-document or here-string (read above): its body becomes the child's stdin
+            if (heredoc_fd == -2) {
+                printError();
+                goto fin;
+            }
+
             // ADJUST FOR ;;
             for (i=0; commandCopy[i] != '\0'; i++) {
                 if (!is_whitespace(commandCopy[i])) break;
@@ -476,9 +1522,11 @@ int main(int argc, char *argv[])
                 // Built-in commands (exit, cd, and pwd)
                 if ((strcmp(no_whitespace, "exit\n") == 0)) {
                     free(no_whitespace);
+                    stats.builtins_run++;
                     exit(0);
                 } else if ((strcmp(no_whitespace, "pwd\n") == 0)) {
                     free(no_whitespace);
+                    stats.builtins_run++;
                     char current_working_directory[FILENAME_MAX];
                     // On the stack
                     getcwd(current_working_directory, sizeof(current_working_directory));
@@ -491,6 +1539,7 @@ int main(int argc, char *argv[])
                 } else if (strstr(commandCopy, "cd")) {
                     if ((strcmp(no_whitespace, "cd\n") == 0)) {
                         free(no_whitespace);
+                        stats.builtins_run++;
                         // Change to home directory
                         if (0 != chdir(getenv("HOME"))) {
                             printError();
@@ -501,6 +1550,7 @@ int main(int argc, char *argv[])
                         continue;
                     } else if (strstr(commandCopy, "cd ")) {
                         free(no_whitespace);
+                        stats.builtins_run++;
                         // Parse the cd line
                         i = 0;
                         while (is_whitespace(commandCopy[i])) i++;
@@ -508,6 +1558,7 @@ int main(int argc, char *argv[])
                         while (is_whitespace(commandCopy[i])) i++;
                         tmpPath = &commandCopy[i];
                         aNumber = strlen(tmpPath);
+                        stats.parser_allocs++;
                         path = (char*) calloc(aNumber + 1, 1);
                         if (path == NULL) {
                             printError();
@@ -537,7 +1588,8 @@ int main(int argc, char *argv[])
             }
 
             // REDIRECTION START: Make a redir_t pointer
-            if (is_redir_in(commandCopy) && strstr(commandCopy, ">+") == NULL) {
+            if (is_redir_in(commandCopy) && strstr(commandCopy, ">+") == NULL &&
+                strstr(commandCopy, ">=") == NULL) {
                 redir = redir_init(commandCopy);
 
                 strcpy(commandCopy, redir->from);
@@ -557,9 +1609,11 @@ int main(int argc, char *argv[])
                     printError();
                     break;
                 }
-                redirection_val = 1;
-            } // Advanced Redirection
-            else if (strstr(commandCopy, ">+")) {
+                redir_kind = REDIR_NEW;
+            } // Advanced Redirection (prepend with ">+", tee with ">=")
+            else if (strstr(commandCopy, ">+") || strstr(commandCopy, ">=")) {
+                redir_kind = strstr(commandCopy, ">=") ? REDIR_TEE : REDIR_PREPEND;
+
                 i = 0;
                 while (commandCopy[i] != '>') i++;
                 commandCopy[i] = '\n';
@@ -588,8 +1642,11 @@ int main(int argc, char *argv[])
                 while (!is_whitespace(filename_buffer[i]) && filename_buffer[i] != '\0') i++;
                 filename_buffer[i] = '\0';
 
-                redirection_val = 1;
-                complex_redirection_val = 1;
+                // Like '>', the tee target should not be an existing file
+                if (redir_kind == REDIR_TEE && is_file_real(redir_ptr)) {
+                    printError();
+                    break;
+                }
             }
 
             // Set arrLen value
@@ -611,6 +1668,7 @@ int main(int argc, char *argv[])
 
             /* first word */
             word = strtok(commandCopy, delim);
+            stats.parser_allocs++;
             arr = (char**) malloc(sizeof(char*)*(arrLen + 1));
             if (arr == NULL) {
                 printError();
@@ -620,6 +1678,7 @@ int main(int argc, char *argv[])
 
             /* get the rest */
             while (word != NULL) {
+                stats.parser_allocs++;
                 arr[i] = (char*) malloc(strlen(word)+1);
                 if (arr[i] == NULL) {
                     printError();
@@ -631,97 +1690,15 @@ int main(int argc, char *argv[])
             }
             arr[arrLen] = NULL; // NULL terminate
 
+            // shellstats runs in-process, the rest
             // fork() and create a new process using execvp()
-            int childState;
-            pid_t childName;
-
-            if (redirection_val == 1 && complex_redirection_val == 1 && is_file_real(redir_ptr))
-            {
-                complex_redirection_val++;
-            }
-
-            if ((childName = fork()) == 0) { // Child process
-                if (redirection_val == 1) {
-                    // Just for child
-                    if (complex_redirection_val == 2) complex_redirection_val--;
-
-                    // 000666 -> All permissions - from man pages
-                    if (complex_redirection_val == 0) {
-                        redirect_fd = open(redir_ptr, O_CREAT | O_RDWR, 000666);
-                    } else if (complex_redirection_val == 1) { // complex_redirection_val == 1
-
-                        if (is_file_real(redir_ptr)) {
-                            if (redirect_fd > 0) close(redirect_fd);
-
-                            redirect_fd = open("bryans_special_filename.txt", O_CREAT | O_RDWR, 000666);
-                        }
-
-                        else if (!is_file_real(redir_ptr)) {
-                            redirect_fd = open(redir_ptr, O_CREAT | O_RDWR, 000666);
-                        }
-                    }
-
-                    if (redirect_fd < 0) {
-                        for (i=0; i<arrLen; i++) {
-                            free(arr[i]);
-                        }
-                        free(arr);
-                        printError();
-                        exit(0);
-                    }
-
-                    if (dup2(redirect_fd, STDOUT_FILENO) < 0) {
-                        printError();
-                        exit(0);
-                    }
-                }
-
-                // Execute the command
-                if (execvp(arr[0], arr) < 0) {
-                    if (redirect_fd > 0) {
-                        close(redirect_fd);
-                    }
-                }
-                // REDIRECTION END
-
-                if (redirect_fd >= 0) {
-                    for (i=0; i<arrLen; i++) {
-                        free(arr[i]);
-                    }
-                    free(arr);
-                }
-
-                // If execvp() is success, should not return
+            if (arrLen == 0) {
+                // Only a redirection, no command
                 printError();
-                exit(1);
-            } else { // Parent process
-                // Wait for child process to finish
-                waitpid(childName, &childState, 0);
-                if (!WIFEXITED(childState)) {
-                    // Error
-                    printError();
-                    continue;
-                }
-            }
-
-            // For Advanced Redirection prepending, if the given file already exists
-            if (redirect_fd > 0) close(redirect_fd);
-            if (complex_redirection_val == 2) {
-                // Copy contents
-                if (0 != file_copy(redir_ptr, "bryans_special_filename.txt")) {
-                    printError();
-                    exit(0);
-                }
-                // Delete old
-                if (0 != remove(redir_ptr)) {
-                    printError();
-                    exit(0);
-                }
-                // Rename new
-                if (0 != rename("bryans_special_filename.txt", redir_ptr)) {
-                    printError();
-                    exit(0);
-                }
+            } else if (strcmp(arr[0], "shellstats") == 0) {
+                run_builtin(arr, arrLen, redir_kind != REDIR_NONE || heredoc_fd >= 0);
+            } else {
+                spawn_command(arr, redir_kind, redir_ptr, heredoc_fd);
             }
 
             for (i=0; i<arrLen; i++) {
@@ -734,6 +1711,12 @@ int main(int argc, char *argv[])
         }
         // END of loop for commands
 
+        if (heredoc_fd >= 0) close(heredoc_fd);
+        for (segment=0; segment<numSegments; segment++) {
+            if (heredoc_fds[segment] >= 0) close(heredoc_fds[segment]);
+        }
+        free(heredoc_fds);
+
         free(commandCpy_to_free);
         // END OF COMMANDS (multiple or single)
 